@@ -4,79 +4,656 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/mount.h>        /* mnt_want_write_file   */
+#include <linux/falloc.h>       /* FALLOC_FL_*           */
+#include <linux/bio.h>          /* bio (O_DIRECT)        */
+#include <linux/blkdev.h>       /* bdev_logical_block_size */
+#include <linux/lz4.h>          /* compresion LZ4        */
+#include <linux/parser.h>       /* opciones de montaje   */
+#include <linux/seq_file.h>     /* show_options          */
+#include <linux/workqueue.h>    /* discard asincrono     */
+#include <linux/crc32c.h>       /* checksums de metadatos */
 #include "assoofs.h"
 
+//Tiempo que se acumulan los bloques liberados antes de hacerles discard de una vez
+#define ASSOOFS_DISCARD_DELAY HZ
+
+/*
+ *  Información del superbloque en memoria: la información persistente, a la que apunta sb->s_fs_info,
+ *  y el estado del montaje
+ */
+struct assoofs_mount_info {
+    struct assoofs_super_block_info info;
+    struct super_block *sb;
+    bool discard;                           //opcion de montaje discard
+    struct mutex free_lock;                 //protege free_blocks, free_inodes, inodes_count, block_shared y pending_discard
+    DECLARE_BITMAP(pending_discard, 64);    //bloques libres apartados hasta que termine su discard
+    struct delayed_work discard_work;
+};
+
+static inline struct assoofs_mount_info *assoofs_mount_info(struct super_block *sb) {
+    return container_of((struct assoofs_super_block_info *)sb->s_fs_info, struct assoofs_mount_info, info);
+}
+
+/*
+ *  En los volúmenes formateados sin ASSOOFS_FEATURE_INODE_FLAGS el campo flags de los inodos era relleno y puede
+ *  tener basura, así que en ellos se lee como 0 y no se deja activar la compresión.
+ */
+static inline bool assoofs_has_inode_flags(struct super_block *sb) {
+    return ((struct assoofs_super_block_info *)sb->s_fs_info)->features & ASSOOFS_FEATURE_INODE_FLAGS;
+}
+
+/*
+ *  i_blocks (st_blocks) cuenta sectores de 512 bytes: los del bloque del fichero, o ninguno si es un hueco.
+ *  Hay que llamarla cada vez que cambia data_block_number.
+ */
+static inline void assoofs_set_i_blocks(struct inode *inode) {
+    struct assoofs_inode_info *inode_info = inode->i_private;
+
+    inode->i_blocks = inode_info->data_block_number ? ASSOOFS_DEFAULT_BLOCK_SIZE >> 9 : 0;
+}
+
+/*
+ *  Checksums de metadatos. Los bloques de metadatos (superbloque, almacén de inodos y directorios) guardan en sus
+ *  últimos 4 bytes el crc32c del resto del bloque. Se comprueba una sola vez, cuando el bloque entra en la caché,
+ *  y el bit BH_Assoofs_Verified del buffer_head evita repetirlo mientras siga en ella.
+ */
+enum {
+    BH_Assoofs_Verified = BH_PrivateStart,
+};
+BUFFER_FNS(Assoofs_Verified, assoofs_verified)
+
+static inline bool assoofs_has_csum(struct super_block *sb) {
+    return ((struct assoofs_super_block_info *)sb->s_fs_info)->features & ASSOOFS_FEATURE_METADATA_CSUM;
+}
+
+static inline uint32_t *assoofs_block_csum(char *data) {
+    return (uint32_t *)(data + ASSOOFS_BLOCK_CHECKSUM_OFFSET);
+}
+
+static inline uint32_t assoofs_compute_csum(char *data) {
+    return crc32c(~0, data, ASSOOFS_BLOCK_CHECKSUM_OFFSET);
+}
+
+/*
+ *  Lee un bloque de metadatos y, si es la primera vez que entra en la caché, comprueba su checksum
+ */
+static struct buffer_head *assoofs_bread_meta(struct super_block *sb, uint64_t block) {
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, block);
+    if (!bh || !assoofs_has_csum(sb) || buffer_assoofs_verified(bh))
+        return bh;
+
+    if (*assoofs_block_csum(bh->b_data) != assoofs_compute_csum(bh->b_data)) {
+        printk(KERN_ERR "Checksum mismatch in metadata block [%llu]\n", block);
+        brelse(bh);
+        return NULL;
+    }
+    set_buffer_assoofs_verified(bh);
+    return bh;
+}
+
+/*
+ *  Actualiza el checksum de un bloque de metadatos y lo vuelca a disco
+ */
+static void assoofs_write_meta(struct super_block *sb, struct buffer_head *bh) {
+    if (assoofs_has_csum(sb)) {
+        *assoofs_block_csum(bh->b_data) = assoofs_compute_csum(bh->b_data);
+        set_buffer_assoofs_verified(bh);
+    }
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+}
+
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
+void assoofs_save_sb_info(struct super_block *vsb);
+int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+int assoofs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+int assoofs_bulkstat(struct super_block *sb, struct assoofs_bulkstat_req __user *ureq);
 
 /*
  *  Operaciones sobre ficheros
  */
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
+ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to);
 ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+long assoofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags);
+ssize_t assoofs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, size_t len, unsigned int flags);
+long assoofs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len);
+loff_t assoofs_llseek(struct file *filp, loff_t offset, int whence);
+int assoofs_open(struct inode *inode, struct file *filp);
 const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
+    .open = assoofs_open,
+    .llseek = assoofs_llseek,
+    .read_iter = assoofs_read_iter,
     .write = assoofs_write,
+    .fallocate = assoofs_fallocate,
+    .unlocked_ioctl = assoofs_ioctl,
+    .remap_file_range = assoofs_remap_file_range,
+    .copy_file_range = assoofs_copy_file_range,
+};
+
+/*
+ *  Operaciones sobre el address_space. El O_DIRECT se hace en assoofs_read_iter/assoofs_write, pero el VFS
+ *  solo deja abrir un fichero con O_DIRECT si hay direct_IO.
+ */
+const struct address_space_operations assoofs_aops = {
+    .direct_IO = noop_direct_IO,
 };
 
-ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
+/*
+ *  Esta función auxiliar suelta la referencia de un fichero a un bloque. El bloque solo vuelve al mapa de bits
+ *  cuando no lo comparte ningún otro fichero.
+ */
+void assoofs_release_block(struct super_block *sb, uint64_t block) {
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+    bool discard = false;
+
+    if (!block)
+        return;     //Hueco, no hay bloque que soltar
+
+    mutex_lock(&mi->free_lock);
+    if (assoofs_sb->block_shared[block]) {
+        assoofs_sb->block_shared[block]--;
+    } else {
+        assoofs_sb->free_blocks |= (1ULL << block);
+        //Con -o discard el bloque no se vuelve a asignar hasta que se le haga discard
+        if (mi->discard) {
+            set_bit(block, mi->pending_discard);
+            discard = true;
+        }
+    }
+    mutex_unlock(&mi->free_lock);
+
+    if (discard)
+        schedule_delayed_work(&mi->discard_work, ASSOOFS_DISCARD_DELAY);
+}
+
+/*
+ *  Copy-on-write: si el bloque del fichero lo comparten otros ficheros (reflink), antes de modificarlo
+ *  el fichero pasa a tener su propia copia.
+ */
+int assoofs_unshare_block(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+    struct buffer_head *bh_old, *bh_new;
+    uint64_t block, old_block;
+    uint8_t shared;
+
+    if (!inode_info->data_block_number)
+        return 0;
+
+    mutex_lock(&mi->free_lock);
+    shared = assoofs_sb->block_shared[inode_info->data_block_number];
+    mutex_unlock(&mi->free_lock);
+    if (!shared)
+        return 0;
+
+    if (assoofs_sb_get_a_freeblock(sb, &block))
+        return -ENOSPC;
+
+    bh_old = sb_bread(sb, inode_info->data_block_number);
+    bh_new = sb_bread(sb, block);
+    if (!bh_old || !bh_new) {
+        printk(KERN_ERR "The process of copying block number [%llu] have failed\n", inode_info->data_block_number);
+        if (bh_old)
+            brelse(bh_old);
+        if (bh_new)
+            brelse(bh_new);
+        assoofs_release_block(sb, block);
+        assoofs_save_sb_info(sb);
+        return -EIO;
+    }
+
+    memcpy(bh_new->b_data, bh_old->b_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    mark_buffer_dirty(bh_new);
+    sync_dirty_buffer(bh_new);
+    brelse(bh_new);
+    brelse(bh_old);
+
+    //Soltamos la referencia al bloque compartido; si entretanto el otro fichero lo ha soltado, se libera
+    old_block = inode_info->data_block_number;
+    inode_info->data_block_number = block;
+    assoofs_release_block(sb, old_block);
+    assoofs_save_sb_info(sb);
+
+    return assoofs_save_inode_info(sb, inode_info);
+}
+
+/*
+ *  Esta función auxiliar da un bloque, ya puesto a cero, a un fichero que todavía no tiene (hueco)
+ */
+int assoofs_alloc_data_block(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+    struct buffer_head *bh;
+    uint64_t block;
+
+    if (inode_info->data_block_number)
+        return 0;
+
+    if (assoofs_sb_get_a_freeblock(sb, &block))
+        return -ENOSPC;
+
+    //No hace falta leerlo de disco, se sobreescribe entero
+    bh = sb_getblk(sb, block);
+    if (!bh) {
+        assoofs_release_block(sb, block);
+        assoofs_save_sb_info(sb);
+        return -EIO;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+
+    inode_info->data_block_number = block;
+    return assoofs_save_inode_info(sb, inode_info);
+}
+
+/*
+ *  Esta función auxiliar copia en data los primeros size bytes del bloque bh de un fichero,
+ *  descomprimiéndolos si el bloque está guardado con LZ4
+ */
+int assoofs_decode_block(struct buffer_head *bh, struct assoofs_inode_info *inode_info, char *data, size_t size) {
+    struct assoofs_compressed_header *header;
+    int nbytes;
+
+    if (inode_info->flags & ASSOOFS_COMPRESSED_FL) {
+        //Solo descomprimimos hasta donde nos piden, no el fichero entero
+        header = (struct assoofs_compressed_header *)bh->b_data;
+        nbytes = -1;
+        if (header->compressed_size <= ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*header))
+            nbytes = LZ4_decompress_safe_partial(bh->b_data + sizeof(*header), data, header->compressed_size, size, ASSOOFS_MAX_FILE_SIZE);
+        if (nbytes < (int)size) {
+            printk(KERN_ERR "Compressed block number [%llu] is corrupted\n", inode_info->data_block_number);
+            return -EIO;
+        }
+    } else {
+        memcpy(data, bh->b_data, min(size, (size_t)ASSOOFS_DEFAULT_BLOCK_SIZE));
+    }
+
+    return 0;
+}
+
+/*
+ *  Esta función auxiliar copia en data los primeros size bytes del contenido de un fichero
+ */
+int assoofs_load_data(struct super_block *sb, struct assoofs_inode_info *inode_info, char *data, size_t size) {
+    struct buffer_head *bh;
+    int ret;
+
+    if (!size)
+        return 0;
+
+    //Un hueco se lee como ceros
+    if (!inode_info->data_block_number) {
+        memset(data, 0, size);
+        return 0;
+    }
+
+    bh = sb_bread(sb, inode_info->data_block_number);
+    if(!bh){
+        printk(KERN_ERR "The process of reading block number [%llu] have failed\n",inode_info->data_block_number);
+        return -EIO;
+    }
+
+    ret = assoofs_decode_block(bh, inode_info, data, size);
+    brelse(bh);
+    return ret;
+}
+
+/*
+ *  Esta función auxiliar guarda size bytes de data como contenido del fichero. Si se ha pedido compresión y compensa,
+ *  el bloque se guarda comprimido con LZ4; si no, se guarda tal cual.
+ */
+int assoofs_store_data(struct super_block *sb, struct assoofs_inode_info *inode_info, const char *data, size_t size) {
+    struct buffer_head *bh;
+    struct assoofs_compressed_header *header;
+    char *compressed = NULL;
+    int nbytes = 0;
+    bool use_lz4;
+    int ret;
+
+    ret = assoofs_unshare_block(sb, inode_info);
+    if (!ret)
+        ret = assoofs_alloc_data_block(sb, inode_info);
+    if (ret)
+        return ret;
+
+    if (inode_info->flags & ASSOOFS_COMPR_FL) {
+        //Comprimimos a un buffer aparte para no tocar el bloque si al final no cabe
+        compressed = kmalloc(LZ4_MEM_COMPRESS + ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+        if (!compressed)
+            return -ENOMEM;
+        nbytes = LZ4_compress_default(data, compressed + LZ4_MEM_COMPRESS, size, ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*header), compressed);
+    }
+
+    //Los datos incompresibles se guardan sin comprimir, siempre que quepan en el bloque
+    use_lz4 = nbytes > 0 && (size > ASSOOFS_DEFAULT_BLOCK_SIZE || nbytes + sizeof(*header) < size);
+    if (!use_lz4 && size > ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        kfree(compressed);
+        return -EFBIG;
+    }
+
+    bh = sb_bread(sb, inode_info->data_block_number);
+    if(!bh){
+        printk(KERN_ERR "The process of reading block number [%llu] have failed\n",inode_info->data_block_number);
+        kfree(compressed);
+        return -EIO;
+    }
+
+    if (use_lz4) {
+        header = (struct assoofs_compressed_header *)bh->b_data;
+        header->compressed_size = nbytes;
+        memcpy(bh->b_data + sizeof(*header), compressed + LZ4_MEM_COMPRESS, nbytes);
+        inode_info->flags |= ASSOOFS_COMPRESSED_FL;
+    } else {
+        memcpy(bh->b_data, data, size);
+        inode_info->flags &= ~ASSOOFS_COMPRESSED_FL;
+    }
+    kfree(compressed);
+
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+
+    //Actualizar campo file_size de la info persistente del inodo
+    inode_info->file_size = size;
+    return assoofs_save_inode_info(sb, inode_info);
+}
+
+/*
+ *  Esta función auxiliar lee o escribe un bloque entre el dispositivo y la página page, sin pasar por la caché de buffers
+ */
+int assoofs_direct_block_io(struct super_block *sb, uint64_t block, struct page *page, unsigned int op) {
+    struct bio *bio;
+    int ret;
+
+    bio = bio_alloc(GFP_NOIO, 1);
+    bio_set_dev(bio, sb->s_bdev);
+    bio->bi_iter.bi_sector = block * (ASSOOFS_DEFAULT_BLOCK_SIZE >> 9);
+    bio->bi_opf = op;
+    bio_add_page(bio, page, ASSOOFS_DEFAULT_BLOCK_SIZE, 0);
+
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    return ret;
+}
+
+/*
+ *  Lectura con O_DIRECT: el bloque se lee del dispositivo sin quedarse en la caché. Devuelve -ENOTBLK cuando
+ *  hay que usar el camino normal (fichero comprimido, hueco, rango no alineado o bloque ya en la caché).
+ */
+ssize_t assoofs_direct_read(struct kiocb *iocb, struct iov_iter *to, size_t nbytes) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh;
+    struct page *page;
+    int ret;
+
+    if ((inode_info->flags & ASSOOFS_COMPRESSED_FL) || !inode_info->data_block_number)
+        return -ENOTBLK;
+    if (!IS_ALIGNED(iocb->ki_pos | iov_iter_count(to), bdev_logical_block_size(sb->s_bdev)))
+        return -ENOTBLK;
+
+    //Si el bloque ya esta en la cache se sirve de ahi, sin ir al dispositivo
+    bh = sb_find_get_block(sb, inode_info->data_block_number);
+    if (bh) {
+        brelse(bh);
+        return -ENOTBLK;
+    }
+
+    page = alloc_page(GFP_KERNEL);
+    if (!page)
+        return -ENOMEM;
+
+    ret = assoofs_direct_block_io(sb, inode_info->data_block_number, page, REQ_OP_READ);
+    if (!ret && copy_to_iter(page_address(page) + iocb->ki_pos, nbytes, to) != nbytes)
+        ret = -EFAULT;
+    __free_page(page);
+    if (ret)
+        return ret;
+
+    iocb->ki_pos += nbytes;
+    return nbytes;
+}
+
+/*
+ *  Escritura con O_DIRECT de un fichero sin comprimir. Si el fichero es un hueco o su bloque está compartido,
+ *  el bloque nuevo se prepara en la página y se escribe sin pasar por la caché de buffers.
+ *  Devuelve -ENOTBLK si el rango no está alineado y hay que usar el camino normal.
+ */
+ssize_t assoofs_direct_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos) {
+    struct inode *inode = file_inode(filp);
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+    uint64_t old_block = inode_info->data_block_number;
+    uint64_t block = old_block, new_block;
+    struct buffer_head *bh;
+    struct page *page;
+    uint8_t shared = 0;
+    int ret = 0;
+
+    if (!IS_ALIGNED(*ppos | len, bdev_logical_block_size(sb->s_bdev)))
+        return -ENOTBLK;
+
+    //Un hueco se lee como ceros, asi que la pagina parte de ceros
+    page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!page)
+        return -ENOMEM;
+
+    //Si no se sobreescribe el bloque entero hay que partir de lo que ya tiene (de la cache si esta ahi)
+    if (old_block) {
+        mutex_lock(&mi->free_lock);
+        shared = assoofs_sb->block_shared[old_block];
+        mutex_unlock(&mi->free_lock);
+
+        bh = sb_find_get_block(sb, old_block);
+        if (bh && buffer_uptodate(bh))
+            memcpy(page_address(page), bh->b_data, ASSOOFS_DEFAULT_BLOCK_SIZE);
+        else if (len != ASSOOFS_DEFAULT_BLOCK_SIZE)
+            ret = assoofs_direct_block_io(sb, old_block, page, REQ_OP_READ);
+        if (bh)
+            brelse(bh);
+    }
+
+    //Sin bloque, o con el bloque compartido (copy-on-write), se escribe en uno nuevo
+    if (!ret && (!old_block || shared)) {
+        if (assoofs_sb_get_a_freeblock(sb, &new_block))
+            ret = -ENOSPC;
+        else
+            block = new_block;
+    }
+
+    if (!ret && copy_from_user(page_address(page) + *ppos, buf, len))
+        ret = -EFAULT;
+    if (!ret)
+        ret = assoofs_direct_block_io(sb, block, page, REQ_OP_WRITE | REQ_SYNC);
+
+    //La copia de la cache, si la hay, no se puede quedar con los datos viejos
+    if (!ret) {
+        bh = sb_find_get_block(sb, block);
+        if (bh) {
+            lock_buffer(bh);
+            memcpy(bh->b_data, page_address(page), ASSOOFS_DEFAULT_BLOCK_SIZE);
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+            brelse(bh);
+        }
+    }
+
+    if (block != old_block) {
+        //Si ha fallado se devuelve el bloque nuevo; si no, el fichero suelta el viejo (si lo tenia)
+        assoofs_release_block(sb, ret ? block : old_block);
+        assoofs_save_sb_info(sb);
+        if (!ret)
+            inode_info->data_block_number = block;
+    }
+    __free_page(page);
+    if (ret)
+        return ret;
+
+    *ppos += len;
+    inode_info->file_size = *ppos;
+    i_size_write(inode, inode_info->file_size);
+    assoofs_save_inode_info(sb, inode_info);  //Guardamos la info del nodo
+
+    return len;
+}
+
+/*
+ *  Lectura de ficheros. Con IOCB_NOWAIT (RWF_NOWAIT, io_uring) solo se atiende si el bloque ya está en la caché;
+ *  si hubiera que ir al dispositivo se devuelve -EAGAIN y el que llama lo reintenta desde un hilo que puede bloquearse.
+ */
+ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
 
     struct assoofs_inode_info *inode_info;
+    struct super_block *sb;
     struct buffer_head *bh;
     char *buffer;
-    int nbytes;
+    size_t nbytes;
+    ssize_t ret;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
 
     printk(KERN_INFO "Read request\n");
 
-    //Obtener la información persistente del inodo a partir de filp
-    inode_info = filp->f_path.dentry->d_inode->i_private;
+    //Obtener la información persistente del inodo a partir del fichero
+    inode_info = file_inode(iocb->ki_filp)->i_private;
+    sb = file_inode(iocb->ki_filp)->i_sb;
 
-    //Comprobar el valor de ppos por si hemos alcanzado el final del fichero
-    if (*ppos >= inode_info->file_size) {
+    //Comprobar el valor de ki_pos por si hemos alcanzado el final del fichero
+    if (iocb->ki_pos >= inode_info->file_size) {
         printk(KERN_INFO "We have reached the end of the file\n");
         return 0;
     }
+    nbytes = min((size_t) (inode_info->file_size - iocb->ki_pos), iov_iter_count(to)); // Hay que comparar lo pedido con lo que queda del fichero por si llegamos al final
 
-    //Accedemos al contenido del fichero
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *)bh->b_data;  //En buffer tenemos el bloque de disco donde esta el fichero
+    //Un fichero sin bloque es un hueco y se lee como ceros
+    if (!inode_info->data_block_number) {
+        nbytes = iov_iter_zero(nbytes, to);
+        iocb->ki_pos += nbytes;
+        return nbytes;
+    }
 
-    if(!bh){
-        printk(KERN_ERR "The process of reading block number [%llu] have failed\n",inode_info->data_block_number);
-        return -1;
+    //O_DIRECT siempre va al dispositivo, asi que con IOCB_NOWAIT se usa el camino normal (solo desde la cache)
+    if ((iocb->ki_flags & IOCB_DIRECT) && !nowait) {
+        ret = assoofs_direct_read(iocb, to, nbytes);
+        if (ret != -ENOTBLK)
+            return ret;
     }
 
-    //Copiar en el buffer buf el contenido del fichero leı́do en el paso anterior con la función copy to user
-    nbytes = min((size_t) inode_info->file_size, len); // Hay que comparar len con el tamano del fichero por si llegamos al final del fichero
-    copy_to_user(buf, buffer, nbytes);
+    //Accedemos al contenido del fichero
+    if (nowait) {
+        bh = sb_find_get_block(sb, inode_info->data_block_number);
+        if (bh && !buffer_uptodate(bh)) {
+            brelse(bh);
+            bh = NULL;
+        }
+        if (!bh)
+            return -EAGAIN;
+    } else {
+        bh = sb_bread(sb, inode_info->data_block_number);
+        if(!bh){
+            printk(KERN_ERR "The process of reading block number [%llu] have failed\n",inode_info->data_block_number);
+            return -EIO;
+        }
+    }
 
+    if (inode_info->flags & ASSOOFS_COMPRESSED_FL) {
+        //Si el fichero esta comprimido, lo descomprimimos hasta donde llega la lectura
+        buffer = kmalloc(ASSOOFS_MAX_FILE_SIZE, nowait ? GFP_NOWAIT : GFP_KERNEL);
+        if (!buffer) {
+            brelse(bh);
+            return nowait ? -EAGAIN : -ENOMEM;
+        }
+        ret = assoofs_decode_block(bh, inode_info, buffer, iocb->ki_pos + nbytes);
+        if (!ret)
+            ret = copy_to_iter(buffer + iocb->ki_pos, nbytes, to);
+        kfree(buffer);
+    } else {
+        //Copiar en el iterador del usuario el contenido del fichero leído en el paso anterior
+        ret = copy_to_iter(bh->b_data + iocb->ki_pos, nbytes, to);
+    }
     brelse(bh);
-    *ppos += nbytes;
 
-    return nbytes; //Sera len (pasado por el ususario) o tam fichero si este es menor que len
+    if (ret < 0)
+        return ret;
+    if (!ret)
+        return -EFAULT;
+
+    iocb->ki_pos += ret;
+    return ret; //Sera lo pedido por el usuario o lo que queda del fichero si es menor
 }
 
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
+/*
+ *  Escritura de un fichero, con inode_lock ya tomado
+ */
+static ssize_t assoofs_write_locked(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
 
     struct assoofs_inode_info *inode_info;
     struct buffer_head *bh;
     struct super_block *sb;
     char *buffer;
-
-    printk(KERN_INFO "Write request\n");
+    int ret;
 
     //Obtener la información persistente del inodo a partir de filp
     inode_info = filp->f_path.dentry->d_inode->i_private;
 
     sb=filp->f_path.dentry->d_inode->i_sb;
 
+    //Los ficheros comprimidos se reconstruyen en memoria, se modifican y se vuelven a comprimir
+    if (inode_info->flags & (ASSOOFS_COMPR_FL | ASSOOFS_COMPRESSED_FL)) {
+        if (*ppos + len > ASSOOFS_MAX_FILE_SIZE)
+            return -EFBIG;
+
+        //Puesto a cero: si se escribe mas alla del final, el trozo intermedio se lee como ceros
+        buffer = kzalloc(ASSOOFS_MAX_FILE_SIZE, GFP_KERNEL);
+        if (!buffer)
+            return -ENOMEM;
+        ret = assoofs_load_data(sb, inode_info, buffer, min((loff_t)inode_info->file_size, *ppos));
+        if (!ret && copy_from_user(buffer + *ppos, buf, len))
+            ret = -EFAULT;
+        if (!ret)
+            ret = assoofs_store_data(sb, inode_info, buffer, *ppos + len);
+        kfree(buffer);
+        if (ret)
+            return ret;
+
+        i_size_write(file_inode(filp), inode_info->file_size);
+        *ppos += len;
+        return len;
+    }
+
+    if (*ppos + len > ASSOOFS_DEFAULT_BLOCK_SIZE)
+        return -EFBIG;
+
+    //O_DIRECT reserva y copia el bloque el mismo, sin traerlo a la cache
+    if (filp->f_flags & O_DIRECT) {
+        ret = assoofs_direct_write(filp, buf, len, ppos);
+        if (ret != -ENOTBLK)
+            return ret;
+    }
+
+    ret = assoofs_unshare_block(sb, inode_info);
+    if (!ret)
+        ret = assoofs_alloc_data_block(sb, inode_info);
+    if (ret)
+        return ret;
+
     //Accedemos al contenido del fichero
     bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *)bh->b_data;  //En buffer tenemos el bloque de disco donde esta el fichero
-
     if(!bh){
         printk(KERN_ERR "The process of reading block number [%llu] have failed\n",inode_info->data_block_number);
         return -1;
     }
+    buffer = (char *)bh->b_data;  //En buffer tenemos el bloque de disco donde esta el fichero
 
     buffer += *ppos;
     copy_from_user(buffer, buf, len);  //Tenemos que escribir en el fichero los datos obtenidos de buf mediante copy_from_user
@@ -87,11 +664,329 @@ ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, l
     sync_dirty_buffer(bh);
     brelse(bh);
 
-    //Actualizar campo file_size de la info persistente del inodo
-    inode_info->file_size = *ppos;
-    assoofs_save_inode_info(sb, inode_info);  //Guardamos la info del nodo
+    //Actualizar campo file_size de la info persistente del inodo
+    inode_info->file_size = *ppos;
+    i_size_write(file_inode(filp), inode_info->file_size);
+    assoofs_save_inode_info(sb, inode_info);  //Guardamos la info del nodo
+
+    return len;
+}
+
+ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
+    struct inode *inode = file_inode(filp);
+    ssize_t ret;
+
+    printk(KERN_INFO "Write request\n");
+
+    //Igual que clone, fallocate y copy_file_range: sin el lock una escritura podria modificar un bloque que se
+    //acaba de compartir, o reservar bloque a la vez que otra y perder uno en el mapa de bits
+    inode_lock(inode);
+    ret = assoofs_write_locked(filp, buf, len, ppos);
+    assoofs_set_i_blocks(inode);   //Puede haber reservado bloque o haberlo cambiado por copy-on-write
+    inode_unlock(inode);
+
+    return ret;
+}
+
+/*
+ *  Al abrir un fichero indicamos que sus lecturas admiten IOCB_NOWAIT
+ */
+int assoofs_open(struct inode *inode, struct file *filp) {
+    filp->f_mode |= FMODE_NOWAIT;
+    return 0;
+}
+
+/*
+ *  ioctl sobre ficheros y directorios: chattr +c / -c (compresión), FITRIM y ASSOOFS_IOC_BULKSTAT
+ */
+long assoofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct inode *inode = file_inode(filp);
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    struct request_queue *q = bdev_get_queue(inode->i_sb->s_bdev);
+    struct fstrim_range range;
+    unsigned int flags;
+    int ret;
+
+    switch (cmd) {
+    case FS_IOC_GETFLAGS:
+        flags = (inode_info->flags & ASSOOFS_COMPR_FL) ? FS_COMPR_FL : 0;
+        return put_user(flags, (int __user *)arg);
+
+    case FS_IOC_SETFLAGS:
+        if (!inode_owner_or_capable(inode))
+            return -EPERM;
+        if (get_user(flags, (int __user *)arg))
+            return -EFAULT;
+        if ((flags & ~FS_COMPR_FL) || ((flags & FS_COMPR_FL) && !assoofs_has_inode_flags(inode->i_sb)))
+            return -EOPNOTSUPP;
+        if (!S_ISREG(inode_info->mode))
+            return -EINVAL;
+
+        ret = mnt_want_write_file(filp);
+        if (ret)
+            return ret;
+
+        //Solo cambia como se guardaran las siguientes escrituras; el bloque actual se sigue leyendo segun ASSOOFS_COMPRESSED_FL
+        inode_lock(inode);
+        if (flags & FS_COMPR_FL)
+            inode_info->flags |= ASSOOFS_COMPR_FL;
+        else
+            inode_info->flags &= ~ASSOOFS_COMPR_FL;
+        ret = assoofs_save_inode_info(inode->i_sb, inode_info);
+        inode->i_ctime = current_time(inode);
+        inode_unlock(inode);
+
+        mnt_drop_write_file(filp);
+        return ret;
+
+    case FITRIM:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (!blk_queue_discard(q))
+            return -EOPNOTSUPP;
+        if (copy_from_user(&range, (struct fstrim_range __user *)arg, sizeof(range)))
+            return -EFAULT;
+
+        range.minlen = max_t(u64, range.minlen, q->limits.discard_granularity);
+        ret = assoofs_trim_fs(inode->i_sb, &range);
+        if (ret)
+            return ret;
+
+        if (copy_to_user((struct fstrim_range __user *)arg, &range, sizeof(range)))
+            return -EFAULT;
+        return 0;
+
+    case ASSOOFS_IOC_BULKSTAT:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        return assoofs_bulkstat(inode->i_sb, (struct assoofs_bulkstat_req __user *)arg);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ *  Clonado (FICLONE / FICLONERANGE): el fichero destino pasa a compartir el bloque del origen, sin copiar datos.
+ *  Como cada fichero tiene un solo bloque, solo se puede clonar el fichero entero.
+ */
+loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags) {
+    struct inode *inode_in = file_inode(file_in);
+    struct inode *inode_out = file_inode(file_out);
+    struct assoofs_inode_info *src = inode_in->i_private;
+    struct assoofs_inode_info *dst = inode_out->i_private;
+    struct super_block *sb = inode_out->i_sb;
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+    int ret;
+
+    printk(KERN_INFO "Remap request\n");
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+        return -EINVAL;
+    if (remap_flags & REMAP_FILE_DEDUP)
+        return -EOPNOTSUPP;
+    if (inode_in->i_sb != sb)
+        return -EXDEV;
+    if (inode_in == inode_out)
+        return -EINVAL;
+
+    //len 0 significa hasta el final del fichero
+    if (!len)
+        len = src->file_size;
+    if (pos_in || pos_out || len < src->file_size)
+        return -EOPNOTSUPP;
+
+    lock_two_nondirectories(inode_in, inode_out);
+
+    //block_shared solo se toca con free_lock, igual que en assoofs_release_block
+    ret = 0;
+    if (src->data_block_number != dst->data_block_number && src->data_block_number) {
+        mutex_lock(&mi->free_lock);
+        if (assoofs_sb->block_shared[src->data_block_number] == U8_MAX)
+            ret = -EOPNOTSUPP;  //No caben mas referencias, que se copie
+        else
+            assoofs_sb->block_shared[src->data_block_number]++;
+        mutex_unlock(&mi->free_lock);
+    }
+
+    if (!ret && src->data_block_number != dst->data_block_number) {
+        //El destino suelta su bloque y apunta al del origen (o se queda sin bloque si el origen es un hueco)
+        assoofs_release_block(sb, dst->data_block_number);
+        assoofs_save_sb_info(sb);
+
+        dst->data_block_number = src->data_block_number;
+        assoofs_set_i_blocks(inode_out);
+        dst->flags = (dst->flags & ~ASSOOFS_COMPRESSED_FL) | (src->flags & ASSOOFS_COMPRESSED_FL);
+        dst->file_size = src->file_size;
+        i_size_write(inode_out, dst->file_size);
+        ret = assoofs_save_inode_info(sb, dst);
+        inode_out->i_mtime = inode_out->i_ctime = current_time(inode_out);
+    }
+
+    unlock_two_nondirectories(inode_in, inode_out);
+
+    return ret ? ret : src->file_size;
+}
+
+/*
+ *  copy_file_range: si se copia el fichero entero se comparte el bloque; si no, se copia dentro del kernel
+ *  sin pasar los datos por el espacio de usuario.
+ */
+ssize_t assoofs_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, size_t len, unsigned int flags) {
+    struct inode *inode_in = file_inode(file_in);
+    struct inode *inode_out = file_inode(file_out);
+    struct assoofs_inode_info *src = inode_in->i_private;
+    struct assoofs_inode_info *dst = inode_out->i_private;
+    struct super_block *sb = inode_out->i_sb;
+    char *src_data, *dst_data;
+    size_t nbytes;
+    loff_t cloned;
+    int ret;
+
+    printk(KERN_INFO "Copy file range request\n");
+
+    if (inode_in->i_sb != sb)
+        return -EXDEV;
+    if (pos_in >= src->file_size)
+        return 0;
+    nbytes = min((size_t)(src->file_size - pos_in), len);
+
+    //Al escribir en assoofs el fichero acaba donde acaba la escritura, asi que copiar el origen entero desde 0 es un clonado
+    if (!pos_in && !pos_out && nbytes == src->file_size && inode_in != inode_out) {
+        cloned = assoofs_remap_file_range(file_in, 0, file_out, 0, 0, 0);
+        if (cloned >= 0)
+            return cloned;
+    }
+
+    if (pos_out + nbytes > ASSOOFS_MAX_FILE_SIZE)
+        return -EFBIG;
+
+    src_data = kmalloc(ASSOOFS_MAX_FILE_SIZE, GFP_KERNEL);
+    dst_data = kzalloc(ASSOOFS_MAX_FILE_SIZE, GFP_KERNEL);  //El trozo entre el final del destino y pos_out queda a cero
+    if (!src_data || !dst_data) {
+        kfree(src_data);
+        kfree(dst_data);
+        return -ENOMEM;
+    }
+
+    inode_lock(inode_out);
+    ret = assoofs_load_data(sb, src, src_data, pos_in + nbytes);
+    if (!ret)
+        ret = assoofs_load_data(sb, dst, dst_data, min((loff_t)dst->file_size, pos_out));
+    if (!ret) {
+        memcpy(dst_data + pos_out, src_data + pos_in, nbytes);
+        ret = assoofs_store_data(sb, dst, dst_data, pos_out + nbytes);
+    }
+    if (!ret) {
+        i_size_write(inode_out, dst->file_size);
+        inode_out->i_mtime = inode_out->i_ctime = current_time(inode_out);
+    }
+    assoofs_set_i_blocks(inode_out);
+    inode_unlock(inode_out);
+
+    kfree(src_data);
+    kfree(dst_data);
+
+    return ret ? ret : nbytes;
+}
+
+/*
+ *  fallocate: reserva el bloque del fichero (puesto a cero) antes de escribir, o con FALLOC_FL_PUNCH_HOLE
+ *  pone a cero un rango, soltando el bloque si el rango cubre el fichero entero.
+ */
+long assoofs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len) {
+    struct inode *inode = file_inode(filp);
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    struct super_block *sb = inode->i_sb;
+    loff_t max_size, size, end;
+    char *data;
+    int ret;
+
+    printk(KERN_INFO "Fallocate request\n");
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+
+    //Sin comprimir, un fichero no puede pasar de un bloque
+    max_size = (inode_info->flags & (ASSOOFS_COMPR_FL | ASSOOFS_COMPRESSED_FL)) ? ASSOOFS_MAX_FILE_SIZE : ASSOOFS_DEFAULT_BLOCK_SIZE;
+    if (!(mode & FALLOC_FL_PUNCH_HOLE) && offset + len > max_size)
+        return -EFBIG;
+
+    inode_lock(inode);
+
+    //Un hueco ya se lee como ceros: no hay que reservarle un bloque para volver a ponerlo a cero
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !inode_info->data_block_number) {
+        inode_unlock(inode);
+        return 0;
+    }
+
+    size = inode_info->file_size;
+    end = min(offset + len, size);
+
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !offset && end == size) {
+        //El hueco cubre todo el fichero: se suelta el bloque
+        assoofs_release_block(sb, inode_info->data_block_number);
+        assoofs_save_sb_info(sb);
+        inode_info->data_block_number = 0;
+        inode_info->flags &= ~ASSOOFS_COMPRESSED_FL;
+        ret = assoofs_save_inode_info(sb, inode_info);
+    } else if ((mode & FALLOC_FL_PUNCH_HOLE) && offset >= end) {
+        ret = 0;    //Rango fuera del fichero, no hay nada que hacer
+    } else if (!(mode & FALLOC_FL_PUNCH_HOLE) && ((mode & FALLOC_FL_KEEP_SIZE) || offset + len <= size)) {
+        //Solo reservar: el bloque ya esta a cero y el tamaño no cambia
+        ret = assoofs_alloc_data_block(sb, inode_info);
+    } else {
+        //Poner a cero un trozo o agrandar el fichero: se reescribe su contenido
+        if (!(mode & FALLOC_FL_PUNCH_HOLE))
+            size = offset + len;
+
+        data = kzalloc(ASSOOFS_MAX_FILE_SIZE, GFP_KERNEL);
+        if (!data) {
+            inode_unlock(inode);
+            return -ENOMEM;
+        }
+        ret = assoofs_load_data(sb, inode_info, data, inode_info->file_size);
+        if (!ret && (mode & FALLOC_FL_PUNCH_HOLE))
+            memset(data + offset, 0, end - offset);
+        if (!ret)
+            ret = assoofs_store_data(sb, inode_info, data, size);
+        kfree(data);
+    }
+
+    if (!ret) {
+        i_size_write(inode, inode_info->file_size);
+        inode->i_mtime = inode->i_ctime = current_time(inode);
+    }
+    assoofs_set_i_blocks(inode);
+    inode_unlock(inode);
+
+    return ret;
+}
 
-    return len;
+/*
+ *  llseek con SEEK_DATA / SEEK_HOLE. Un fichero es todo datos si tiene bloque y todo hueco si no lo tiene.
+ */
+loff_t assoofs_llseek(struct file *filp, loff_t offset, int whence) {
+    struct assoofs_inode_info *inode_info = file_inode(filp)->i_private;
+    loff_t size = inode_info->file_size;
+
+    switch (whence) {
+    case SEEK_DATA:
+        if (offset < 0 || offset >= size || !inode_info->data_block_number)
+            return -ENXIO;
+        break;
+    case SEEK_HOLE:
+        if (offset < 0 || offset >= size)
+            return -ENXIO;
+        if (inode_info->data_block_number)
+            offset = size;  //Hueco implicito al final del fichero
+        break;
+    default:
+        return generic_file_llseek_size(filp, offset, whence, ASSOOFS_MAX_FILE_SIZE, size);
+    }
+
+    return vfs_setpos(filp, offset, ASSOOFS_MAX_FILE_SIZE);
 }
 
 /*
@@ -101,6 +996,7 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
 const struct file_operations assoofs_dir_operations = {
     .owner = THIS_MODULE,
     .iterate = assoofs_iterate,
+    .unlocked_ioctl = assoofs_ioctl,
 };
 
 
@@ -136,7 +1032,9 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
     }
 
     //Accedemos al bloque donde se almacena el contenido del directorio y con la información que contiene inicializamos el contexto ctx:
-    bh = sb_bread(sb, inode_info->data_block_number);  //Leemos el bloque
+    bh = assoofs_bread_meta(sb, inode_info->data_block_number);  //Leemos el bloque
+    if (!bh)
+        return -EIO;
     record = (struct assoofs_dir_record_entry *)bh->b_data;
     for (i = 0; i < inode_info->dir_children_count; i++) {
         dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN); //Inicializar variables de ctx con valores del directorio
@@ -156,39 +1054,113 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
 static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
 static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry);
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry);
 static struct inode_operations assoofs_inode_ops = {
     .create = assoofs_create,
     .lookup = assoofs_lookup,
     .mkdir = assoofs_mkdir,
+    .unlink = assoofs_unlink,
+    .rmdir = assoofs_rmdir,
 };
 
 /*
- *  Funcion auxiliar nos permite obtener la informacion persistente del inodo numero inode_no del superbloque sb
+ *  El inodo numero n ocupa siempre la entrada n-1 del almacen de inodos, asi que se localiza en O(1)
+ */
+static inline struct assoofs_inode_info *assoofs_inode_slot(struct assoofs_inode_info *store, uint64_t inode_no){
+    if (inode_no < ASSOOFS_ROOTDIR_INODE_NUMBER || inode_no >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+        return NULL;
+    return store + (inode_no - ASSOOFS_ROOTDIR_INODE_NUMBER);
+}
+
+/*
+ *  Funcion auxiliar nos permite obtener la informacion persistente del inodo numero inode_no del superbloque sb.
+ *  Devuelve ERR_PTR(-EIO) si no se puede leer o no esta en el almacen, y ERR_PTR(-ENOMEM) si no hay memoria.
  */
 struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no){
     //Accedemos a disco para leer el bloque que contiene el almacen de inodos
     struct assoofs_inode_info *inode_info = NULL;
     struct buffer_head *bh;
-    struct assoofs_super_block_info *afs_sb = sb->s_fs_info; //Idea no tener que acceder siempre al bloque 0, lo guardamos en esta variable
     struct assoofs_inode_info *buffer = NULL;
-    int i;
 
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);   //Leemos bloque 1
-    inode_info = (struct assoofs_inode_info *)bh->b_data; //Hacemos conversion
-
-    //Recorrer el almacen de inodos en busca del inodo inode_no
-    for (i = 0; i < afs_sb->inodes_count; i++) {      //Nada mas arrancar, num inodos es 2 (raiz y fich bienvenida)
-        if (inode_info->inode_no == inode_no) {
-            buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-            memcpy(buffer, inode_info, sizeof(*buffer));
-            break;
+    bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);   //Leemos bloque 1
+    if (!bh)
+        return ERR_PTR(-EIO);
+
+    //Vamos directamente a la entrada del inodo inode_no; si esta libre su inode_no vale 0
+    inode_info = assoofs_inode_slot((struct assoofs_inode_info *)bh->b_data, inode_no);
+    if (inode_info && inode_info->inode_no == inode_no) {
+        buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
+        if (!buffer) {
+            brelse(bh);
+            return ERR_PTR(-ENOMEM);
         }
-        inode_info++;   //++ en puntero: incrementar tantos bytes como ocupe una variable y pasa a la segunda
+        memcpy(buffer, inode_info, sizeof(*buffer));
+        if (!assoofs_has_inode_flags(sb))
+            buffer->flags = 0;  //Al guardarlo se limpia tambien en disco
     }
 
     //Liberamos recursos y devolvemos la informacion del inodo inode_no, si estaba en el almacen
     brelse(bh);
-    return buffer;
+    return buffer ? buffer : ERR_PTR(-EIO);
+}
+
+/*
+ *  Bulkstat: recorre el almacén de inodos de una pasada a partir de req.cursor y devuelve hasta req.count inodos,
+ *  sin tener que hacer un lookup por fichero
+ */
+int assoofs_bulkstat(struct super_block *sb, struct assoofs_bulkstat_req __user *ureq) {
+    struct assoofs_bulkstat_req req;
+    struct assoofs_bulkstat_entry *entries;
+    struct assoofs_inode_info *inode_info;
+    struct buffer_head *bh;
+    uint64_t inode_no;
+    uint32_t count = 0;
+    int ret = 0;
+
+    printk(KERN_INFO "Bulkstat request\n");
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+
+    req.count = min_t(uint32_t, req.count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+    entries = kmalloc_array(max_t(uint32_t, req.count, 1), sizeof(*entries), GFP_KERNEL);
+    if (!entries)
+        return -ENOMEM;
+
+    bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if (!bh) {
+        kfree(entries);
+        return -EIO;
+    }
+
+    inode_no = max_t(uint64_t, req.cursor, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    for (; inode_no < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED && count < req.count; inode_no++) {
+        inode_info = assoofs_inode_slot((struct assoofs_inode_info *)bh->b_data, inode_no);
+        if (inode_info->inode_no != inode_no)
+            continue;   //Entrada libre
+
+        entries[count].inode_no = inode_info->inode_no;
+        entries[count].mode = inode_info->mode;
+        entries[count].flags = assoofs_has_inode_flags(sb) ? inode_info->flags : 0;
+        entries[count].size = inode_info->file_size;
+        entries[count].data_block_number = inode_info->data_block_number;
+        count++;
+    }
+    brelse(bh);
+
+    if (copy_to_user(u64_to_user_ptr(req.entries), entries, count * sizeof(*entries)))
+        ret = -EFAULT;
+    kfree(entries);
+    if (ret)
+        return ret;
+
+    req.cursor = inode_no;
+    req.count = count;
+    if (copy_to_user(ureq, &req, sizeof(req)))
+        return -EFAULT;
+
+    return 0;
 }
 
 /*
@@ -200,9 +1172,15 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
 
     //Obtener la información persistente del inodo ino
     inode_info = assoofs_get_inode_info(sb, ino);
+    if (IS_ERR(inode_info))
+        return ERR_CAST(inode_info);
 
     //Asignamos
     inode=new_inode(sb);
+    if (!inode) {
+        kfree(inode_info);
+        return ERR_PTR(-ENOMEM);
+    }
     inode->i_ino = ino; 
     inode->i_sb = sb; 
     inode->i_op = &assoofs_inode_ops; 
@@ -212,6 +1190,8 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
         inode->i_fop = &assoofs_dir_operations;
     }else if (S_ISREG(inode_info->mode)){
         inode->i_fop = &assoofs_file_operations;
+        inode->i_mapping->a_ops = &assoofs_aops;
+        i_size_write(inode, inode_info->file_size);  //El VFS (copy_file_range, stat) mira i_size, no file_size
     }else{
         printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
     }
@@ -219,6 +1199,7 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
     //Demas
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode); 
     inode->i_private = inode_info;
+    assoofs_set_i_blocks(inode);
 
     return inode;
 }
@@ -240,7 +1221,9 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
 
     printk(KERN_INFO "Lookup request\n");
 
-    bh = sb_bread(sb, parent_info->data_block_number);
+    bh = assoofs_bread_meta(sb, parent_info->data_block_number);
+    if (!bh)
+        return ERR_PTR(-EIO);
 
     /*  Recorrer el contenido del directorio buscando la entrada cuyo nombre se corresponda con el que buscamos. Si se localiza
         la entrada, entonces tenemos construir el inodo correspondiente */
@@ -249,6 +1232,9 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
     for (i=0; i < parent_info->dir_children_count; i++) {
         if (!strcmp(record->filename, child_dentry->d_name. name)) { //Se ejecuta cuando son iguales
             struct inode *inode = assoofs_get_inode(sb, record->inode_no); // Función auxiliar que obtine la información de un inodo a partir de su número de inodo
+            brelse(bh);
+            if (IS_ERR(inode))
+                return ERR_CAST(inode);
             inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);
             d_add(child_dentry, inode); //Construye arbol de inodos en mem
             return NULL;
@@ -257,6 +1243,7 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
     }
 
     printk(KERN_ERR "No inode found for the filename: [%s]\n", child_dentry->d_name.name);
+    brelse(bh);
 
     return NULL;
 }
@@ -266,15 +1253,10 @@ struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_d
  *  Esta función auxiliar nos permitirá obtener un puntero a la información persistente de un inodo concreto
  */
 struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search){
-    uint64_t count = 0;
-    
-    while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count) {
-        count++;
-        start++;
-    }
+    struct assoofs_inode_info *slot = assoofs_inode_slot(start, search->inode_no);
 
-    if(start->inode_no == search->inode_no){
-        return start;
+    if(slot && slot->inode_no == search->inode_no){
+        return slot;
     }else{
         return NULL;
     }
@@ -288,15 +1270,21 @@ int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *i
     struct assoofs_inode_info *inode_pos;
 
     //Obtener de disco el almacén de inodos.
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if (!bh)
+        return -EIO;
 
     //Buscar los datos de inode info en el almacén. Para ello se recomienda utilizar una función auxiliar
     inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+    if (!inode_pos) {
+        printk(KERN_ERR "inode [%llu] not found in the inode store\n", inode_info->inode_no);
+        brelse(bh);
+        return -EIO;
+    }
 
     //Actualizar el inodo, marcar el bloque como sucio y sincronizar.
     memcpy(inode_pos, inode_info, sizeof(*inode_pos));
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    assoofs_write_meta(sb, bh);
 
     brelse(bh);
 
@@ -311,13 +1299,12 @@ int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *i
 void assoofs_save_sb_info(struct super_block *vsb){
     //Leer de disco la información persistente del superbloque con sb bread y sobreescribir el campo b_data con la informacion en memoria:
     struct buffer_head *bh; //Para grabar en disco
-    struct assoofs_super_block *sb = vsb->s_fs_info; // Información persistente del superbloque en memoria
+    struct assoofs_super_block_info *sb = vsb->s_fs_info; // Información persistente del superbloque en memoria
     bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER); //Accedemos a disco
-    bh->b_data = (char *)sb; // Sobreescribo los datos de disco con la información en memoria
+    memcpy(bh->b_data, sb, sizeof(*sb)); // Sobreescribo los datos de disco con la información en memoria
 
-    //Para que el cambio pase a disco, basta con marcar el buffer como sucio y sincronizar
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    //Para que el cambio pase a disco, basta con recalcular el checksum, marcar el buffer como sucio y sincronizar
+    assoofs_write_meta(vsb, bh);
     brelse(bh);
 }
 
@@ -327,10 +1314,12 @@ void assoofs_save_sb_info(struct super_block *vsb){
  */
 int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
     struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
     int i;
 
+    mutex_lock(&mi->free_lock);
     for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++){ //Desde 2, pues super y alm inodos (bloque 0 y 1)
-        if (assoofs_sb->free_blocks & (1 << i)){ //comprobar bit del indice esta libre o no
+        if ((assoofs_sb->free_blocks & (1ULL << i)) && !test_bit(i, mi->pending_discard)){ //comprobar bit del indice esta libre o no (y no esta esperando un discard)
             break; // cuando aparece el primer bit 1 en free_block dejamos de recorrer el mapa de bits, i tiene la posición del primer bloque libre
         }
     }
@@ -338,23 +1327,91 @@ int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
     *block = i; // Escribimos el valor de i en la dirección de memoria indicada como segundo argumento en la función
 
     if(i== ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+        mutex_unlock(&mi->free_lock);
         printk(KERN_ERR "There are no more free blocks avalible\n");
-        return -1;
+        return -ENOSPC;
     }
 
     //Por último, hay que actualizar el valor de free blocks y guardar los cambios en el superbloque.
-    assoofs_sb->free_blocks &= ~(1 << i);
+    assoofs_sb->free_blocks &= ~(1ULL << i);
+    mutex_unlock(&mi->free_lock);
     assoofs_save_sb_info(sb);
     return 0;
     
 }
 
 
+/*
+ *  Esta función auxiliar nos permitirá obtener un número de inodo libre en O(1):
+ */
+int assoofs_sb_get_a_freeinode(struct super_block *sb, uint64_t *inode_no){
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+
+    //Los numeros libres estan a 1 en free_inodes, nos quedamos con el mas bajo
+    mutex_lock(&mi->free_lock);
+    if (!assoofs_sb->free_inodes){
+        mutex_unlock(&mi->free_lock);
+        printk(KERN_ERR "There are no more free inodes avalible\n");
+        return -ENOSPC;
+    }
+
+    *inode_no = __ffs64(assoofs_sb->free_inodes);
+    if (*inode_no >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+        mutex_unlock(&mi->free_lock);
+        printk(KERN_ERR "There are no more free inodes avalible\n");
+        return -ENOSPC;
+    }
+
+    //El superbloque se guarda en assoofs_add_inode_info, junto con el nuevo contador de inodos
+    assoofs_sb->free_inodes &= ~(1ULL << *inode_no);
+    mutex_unlock(&mi->free_lock);
+    return 0;
+}
+
+/*
+ *  Esta función auxiliar devuelve al mapa un número de inodo reservado que al final no se ha llegado a usar
+ */
+void assoofs_put_freeinode(struct super_block *sb, uint64_t inode_no){
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+
+    mutex_lock(&mi->free_lock);
+    assoofs_sb->free_inodes |= (1ULL << inode_no);
+    mutex_unlock(&mi->free_lock);
+}
+
+/*
+ *  En los volúmenes de antes del mapa de inodos libres, free_inodes era relleno y vale 0. Se reconstruye a partir
+ *  del almacén de inodos: la entrada n-1 está ocupada si su inode_no vale n.
+ */
+int assoofs_rebuild_free_inodes(struct super_block *sb){
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_inode_info *inode_info;
+    struct buffer_head *bh;
+    uint64_t inode_no;
+
+    bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if (!bh)
+        return -EIO;
+
+    for (inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER; inode_no < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; inode_no++) {
+        inode_info = assoofs_inode_slot((struct assoofs_inode_info *)bh->b_data, inode_no);
+        if (inode_info->inode_no != inode_no)
+            assoofs_sb->free_inodes |= (1ULL << inode_no);
+    }
+    brelse(bh);
+
+    return 0;
+}
+
+
 /*
  *  Esta función auxiliar nos permitirá guardar en disco la información persistente de un inodo nuevo
  */
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
+int assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode){
     struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
     uint64_t count;
     struct buffer_head *bh;
     struct assoofs_inode_info *inode_info;
@@ -363,17 +1420,19 @@ void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *i
     count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count;
 
     //Leer de disco el bloque que contiene el almacén de inodos.
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); 
+    bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if (!bh)
+        return -EIO;
 
-    //Obtener un puntero al final del almacén y escribir un nuevo valor al final.
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
-    inode_info += assoofs_sb->inodes_count;
+    //Obtener un puntero a la entrada que corresponde a su numero de inodo (que puede ser un hueco liberado) y escribir ahi.
+    inode_info = assoofs_inode_slot((struct assoofs_inode_info *)bh->b_data, inode->inode_no);
     memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));   //Copia de mem la info del inodo y cuantos bytes se copian
+    mutex_lock(&mi->free_lock);
     assoofs_sb->inodes_count++;
+    mutex_unlock(&mi->free_lock);
 
     //Para que los cambios persistan
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    assoofs_write_meta(sb, bh);
 
 
     //Actualizar el contador de inodos de la informacion persistente del superbloque y guardar los cambios.
@@ -381,6 +1440,7 @@ void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *i
     assoofs_save_sb_info(sb);
 
     brelse(bh);
+    return 0;
 }
 
 
@@ -389,10 +1449,13 @@ static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode
     //Creamos un inodo, con algunas consideraciones:
     struct inode *inode;
     uint64_t count;
+    uint64_t ino;
     struct assoofs_inode_info *inode_info;
 
     struct super_block *sb;
+    struct assoofs_super_block_info *assoofs_sb;
     struct buffer_head *bh;
+    int ret;
 
     struct assoofs_inode_info *parent_inode_info;
     struct assoofs_dir_record_entry *dir_contents;
@@ -401,54 +1464,83 @@ static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode
 
     /* ==== PARTE 1: ==== */
     sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el número de inodos de la información persistente del superbloque
-    inode = new_inode(sb);
-    
-    inode->i_ino = (count + 1); // Asigno número al nuevo inodo a partir de count
+    assoofs_sb = sb->s_fs_info;
+    count = assoofs_sb->inodes_count; // obtengo el número de inodos de la información persistente del superbloque
+
+    //El bloque del directorio padre se lee (y se verifica) antes de reservar nada, para no dejar nada a medias si falla
+    parent_inode_info = dir->i_private; //Sacamos info persistente del padre
+    bh = assoofs_bread_meta(sb, parent_inode_info->data_block_number);  //Leemos el contenido del disco del bloque del dir padre
+    if (!bh)
+        return -EIO;
+
+    if(parent_inode_info->dir_children_count >= ASSOOFS_MAX_DIR_ENTRIES){
+        printk(KERN_ERR "Directory [%llu] is full\n", parent_inode_info->inode_no);
+        brelse(bh);
+        return -ENOSPC;
+    }
 
-    if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+    if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED || assoofs_sb_get_a_freeinode(sb, &ino)){
         printk(KERN_ERR "Max number of objects supported by ASSOOFS has been reached\n");
-        return -1;
+        brelse(bh);
+        return -ENOSPC;
+    }
+
+    inode = new_inode(sb);
+    if (!inode) {
+        assoofs_put_freeinode(sb, ino);
+        brelse(bh);
+        return -ENOMEM;
     }
+    inode->i_ino = ino; // Asigno al nuevo inodo el primer número libre (puede ser uno liberado por unlink/rmdir)
 
     /*  Hay que guardar en el campo i private la información persistente del mismo (struct assoofs inode info). 
         En este caso, no llamo a assoofs get inode info, se trata de un nuevo inodo y tengo que crearlo desde cero  */
     inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
+    if (!inode_info) {
+        assoofs_put_freeinode(sb, ino);
+        iput(inode);
+        brelse(bh);
+        return -ENOMEM;
+    }
     inode_info->inode_no = inode->i_ino;
     inode_info->mode = mode; // El segundo mode me llega como argumento
+    inode_info->flags = 0;
     inode_info->file_size = 0;
 
     inode->i_private = inode_info;
+    i_size_write(inode, 0);
     
     //Para las operaciones sobre ficheros
     inode->i_fop=&assoofs_file_operations;
+    inode->i_mapping->a_ops = &assoofs_aops;
     inode->i_op = &assoofs_inode_ops;
     inode->i_sb = sb;
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode); // Fechas
     
     inode_init_owner(inode, dir, mode);
-    d_add(dentry, inode);
 
     
-    //Hay que asignarle un bloque al nuevo inodo, por lo que habrá que consultar el mapa de bits del superbloque.
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number); //Direccion donde se escribe el bloque del fichero
-
-    //Guardar la información persistente del nuevo inodo en disco
-    assoofs_add_inode_info(sb, inode_info);
+    //El bloque del fichero no se reserva hasta que se escribe en el o se hace fallocate: mientras tanto es un hueco.
+    inode_info->data_block_number = 0;
+
+    //Guardar la información persistente del nuevo inodo en disco; si falla, se devuelve el número de inodo
+    ret = assoofs_add_inode_info(sb, inode_info);
+    if (ret) {
+        assoofs_put_freeinode(sb, ino);
+        iput(inode);
+        brelse(bh);
+        return ret;
+    }
 
 
     /* ==== PARTE 2: ===== */
-    //Modificar el contenido del directorio padre, añadiendo una nueva entrada para el nuevo archivo o directorio. El nombre lo sacaremos del segundo parámetro.
-    parent_inode_info = dir->i_private; //Sacamos info persistente del padre 
-    bh = sb_bread(sb, parent_inode_info->data_block_number);  //Leemos el contenido del disco del bloque del dir padre
-
+    //Modificar el contenido del directorio padre (leído en la parte 1), añadiendo una nueva entrada para el nuevo archivo o directorio. El nombre lo sacaremos del segundo parámetro.
     dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
     dir_contents += parent_inode_info->dir_children_count; //Avanzar el puntero para llegar al final (fig, tercer bloque, final amarillo)
     dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
 
     strcpy(dir_contents->filename, dentry->d_name.name);
-    mark_buffer_dirty(bh);  //Marcar como sucio
-    sync_dirty_buffer(bh);  //Volcar todos los cambios en bh a disco
+    assoofs_write_meta(sb, bh);  //Recalcular el checksum, marcar como sucio y volcar a disco
     brelse(bh);
 
 
@@ -457,6 +1549,8 @@ static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode
     parent_inode_info->dir_children_count++;
     assoofs_save_inode_info(sb, parent_inode_info); 
 
+    //El nuevo inodo solo pasa a la dentry cuando ya está en disco
+    d_add(dentry, inode);
     return 0;
 }
 
@@ -468,10 +1562,14 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
     //Creamos un inodo, con algunas consideraciones:
     struct inode *inode;
     uint64_t count;
+    uint64_t ino;
+    uint64_t block;
     struct assoofs_inode_info *inode_info;
 
     struct super_block *sb;
-    struct buffer_head *bh;
+    struct assoofs_super_block_info *assoofs_sb;
+    struct buffer_head *bh, *block_bh;
+    int ret;
 
     struct assoofs_inode_info *parent_inode_info;
     struct assoofs_dir_record_entry *dir_contents;
@@ -480,21 +1578,47 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
 
     /* ==== PARTE 1: ==== */
     sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el número de inodos de la información persistente del superbloque
-    inode = new_inode(sb);
-    
-    inode->i_ino = (count + 1); // Asigno número al nuevo inodo a partir de count
+    assoofs_sb = sb->s_fs_info;
+    count = assoofs_sb->inodes_count; // obtengo el número de inodos de la información persistente del superbloque
+
+    //El bloque del directorio padre se lee (y se verifica) antes de reservar nada, para no dejar nada a medias si falla
+    parent_inode_info = dir->i_private; //Sacamos info persistente del padre
+    bh = assoofs_bread_meta(sb, parent_inode_info->data_block_number);  //Leemos el contenido del disco del bloque del dir padre
+    if (!bh)
+        return -EIO;
+
+    if(parent_inode_info->dir_children_count >= ASSOOFS_MAX_DIR_ENTRIES){
+        printk(KERN_ERR "Directory [%llu] is full\n", parent_inode_info->inode_no);
+        brelse(bh);
+        return -ENOSPC;
+    }
 
-    if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
+    if(count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED || assoofs_sb_get_a_freeinode(sb, &ino)){
         printk(KERN_ERR "Max number of objects supported by ASSOOFS has been reached\n");
-        return -1;
+        brelse(bh);
+        return -ENOSPC;
     }
+
+    inode = new_inode(sb);
+    if (!inode) {
+        assoofs_put_freeinode(sb, ino);
+        brelse(bh);
+        return -ENOMEM;
+    }
+    inode->i_ino = ino; // Asigno al nuevo inodo el primer número libre (puede ser uno liberado por unlink/rmdir)
  
     /*  Hay que guardar en el campo i private la información persistente del mismo (struct assoofs inode info). 
         En este caso, no llamo a assoofs get inode info, se trata de un nuevo inodo y tengo que crearlo desde cero  */
     inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
+    if (!inode_info) {
+        assoofs_put_freeinode(sb, ino);
+        iput(inode);
+        brelse(bh);
+        return -ENOMEM;
+    }
     inode_info->inode_no = inode->i_ino;
     inode_info->mode = S_IFDIR | mode; //CAMBIO
+    inode_info->flags = 0;
     inode_info->dir_children_count = 0;  //CAMBIO
 
     
@@ -507,29 +1631,51 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
     inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode); // Fechas
 
     inode_init_owner(inode, dir, inode_info->mode);
-    d_add(dentry, inode);
 
     
 
     //Hay que asignarle un bloque al nuevo inodo, por lo que habrá que consultar el mapa de bits del superbloque.
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number); //Direccion donde se escribe el bloque del fichero
-
-    //Guardar la información persistente del nuevo inodo en disco
-    assoofs_add_inode_info(sb, inode_info);
+    if (assoofs_sb_get_a_freeblock(sb, &block)) {
+        assoofs_put_freeinode(sb, ino);
+        iput(inode);
+        brelse(bh);
+        return -ENOSPC;
+    }
+    inode_info->data_block_number = block; //Direccion donde se escribe el bloque del fichero
+    assoofs_set_i_blocks(inode);
+
+    //El bloque puede tener restos de un fichero borrado: se deja vacio y con su checksum
+    block_bh = sb_getblk(sb, block);
+    ret = -EIO;
+    if (block_bh) {
+        lock_buffer(block_bh);
+        memset(block_bh->b_data, 0, block_bh->b_size);
+        set_buffer_uptodate(block_bh);
+        unlock_buffer(block_bh);
+        assoofs_write_meta(sb, block_bh);
+        brelse(block_bh);
+
+        //Guardar la información persistente del nuevo inodo en disco
+        ret = assoofs_add_inode_info(sb, inode_info);
+    }
+    if (ret) {
+        assoofs_release_block(sb, block);
+        assoofs_save_sb_info(sb);
+        assoofs_put_freeinode(sb, ino);
+        iput(inode);
+        brelse(bh);
+        return ret;
+    }
 
 
     /* ==== PARTE 2: ===== */
-    //Modificar el contenido del directorio padre, añadiendo una nueva entrada para el nuevo archivo o directorio. El nombre lo sacaremos del segundo parámetro.
-    parent_inode_info = dir->i_private; //Sacamos info persistente del padre 
-    bh = sb_bread(sb, parent_inode_info->data_block_number);  //Leemos el contenido del disco del bloque del dir padre
-
+    //Modificar el contenido del directorio padre (leído en la parte 1), añadiendo una nueva entrada para el nuevo archivo o directorio. El nombre lo sacaremos del segundo parámetro.
     dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
     dir_contents += parent_inode_info->dir_children_count; //Avanzar el puntero para llegar al final (fig, tercer bloque, final amarillo)
     dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
 
     strcpy(dir_contents->filename, dentry->d_name.name);
-    mark_buffer_dirty(bh);  //Marcar como sucio
-    sync_dirty_buffer(bh);  //Volcar todos los cambios en bh a disco
+    assoofs_write_meta(sb, bh);  //Recalcular el checksum, marcar como sucio y volcar a disco
     brelse(bh);
 
 
@@ -538,16 +1684,296 @@ static int assoofs_mkdir(struct inode *dir , struct dentry *dentry, umode_t mode
     parent_inode_info->dir_children_count++;
     assoofs_save_inode_info(sb, parent_inode_info); 
 
+    //El nuevo inodo solo pasa a la dentry cuando ya está en disco
+    d_add(dentry, inode);
+    return 0;
+}
+
+/*
+ *  Esta función auxiliar quita del directorio padre la entrada con el nombre name.
+ *  Para no desplazar todo el directorio, la última entrada pasa a ocupar el hueco.
+ */
+int assoofs_remove_dir_entry(struct super_block *sb, struct assoofs_inode_info *parent_inode_info, const char *name){
+    struct buffer_head *bh;
+    struct assoofs_dir_record_entry *record, *last;
+    int i;
+
+    bh = assoofs_bread_meta(sb, parent_inode_info->data_block_number);  //Leemos el contenido del disco del bloque del dir padre
+    if(!bh){
+        printk(KERN_ERR "The process of reading block number [%llu] have failed\n", parent_inode_info->data_block_number);
+        return -EIO;
+    }
+
+    record = (struct assoofs_dir_record_entry *)bh->b_data;
+    last = record + parent_inode_info->dir_children_count - 1;
+    for (i = 0; i < parent_inode_info->dir_children_count; i++) {
+        if (!strcmp(record->filename, name))
+            break;
+        record++;
+    }
+
+    if (i == parent_inode_info->dir_children_count) {
+        printk(KERN_ERR "No entry found for the filename: [%s]\n", name);
+        brelse(bh);
+        return -ENOENT;
+    }
+
+    if (record != last)
+        memcpy(record, last, sizeof(*record));
+    memset(last, 0, sizeof(*last));
+    assoofs_write_meta(sb, bh);
+    brelse(bh);
+
+    //El padre tiene ahora un archivo menos
+    parent_inode_info->dir_children_count--;
+    return assoofs_save_inode_info(sb, parent_inode_info);
+}
+
+/*
+ *  Esta función auxiliar devuelve a los mapas de bits el bloque y el número de un inodo borrado, y deja libre su entrada del almacén
+ */
+void assoofs_free_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info){
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+    struct buffer_head *bh;
+    struct assoofs_inode_info *inode_pos;
+
+    bh = assoofs_bread_meta(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if (bh) {
+        inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
+        if (inode_pos) {
+            memset(inode_pos, 0, sizeof(*inode_pos));  //inode_no a 0 marca la entrada como libre
+            assoofs_write_meta(sb, bh);
+        }
+        brelse(bh);
+    }
+
+    assoofs_release_block(sb, inode_info->data_block_number);
+    mutex_lock(&mi->free_lock);
+    assoofs_sb->free_inodes |= (1ULL << inode_info->inode_no);
+    assoofs_sb->inodes_count--;
+    mutex_unlock(&mi->free_lock);
+    assoofs_save_sb_info(sb);
+}
+
+/*
+ *  Esta función borra un fichero. El bloque y el inodo se liberan en assoofs_evict_inode, cuando nadie lo tiene abierto.
+ */
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    printk(KERN_INFO "Unlink request\n");
+
+    ret = assoofs_remove_dir_entry(dir->i_sb, dir->i_private, dentry->d_name.name);
+    if (ret)
+        return ret;
+
+    dir->i_ctime = dir->i_mtime = inode->i_ctime = current_time(inode);
+    drop_nlink(inode);
+    return 0;
+}
+
+/*
+ *  Esta función borra un directorio, que tiene que estar vacío.
+ */
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    int ret;
+
+    printk(KERN_INFO "Remove directory request\n");
+
+    if (inode_info->dir_children_count)
+        return -ENOTEMPTY;
+
+    ret = assoofs_remove_dir_entry(dir->i_sb, dir->i_private, dentry->d_name.name);
+    if (ret)
+        return ret;
+
+    dir->i_ctime = dir->i_mtime = inode->i_ctime = current_time(inode);
+    clear_nlink(inode);
     return 0;
 }
 
 /*
  *  Operaciones sobre el superbloque
  */
+static void assoofs_evict_inode(struct inode *inode);
+static void assoofs_put_super(struct super_block *sb);
+static int assoofs_show_options(struct seq_file *m, struct dentry *root);
 static const struct super_operations assoofs_sops = {
     .drop_inode = generic_delete_inode,
+    .evict_inode = assoofs_evict_inode,
+    .put_super = assoofs_put_super,
+    .show_options = assoofs_show_options,
+};
+
+/*
+ *  Esta función auxiliar hace discard de nr bloques consecutivos a partir de block
+ */
+int assoofs_discard_blocks(struct super_block *sb, uint64_t block, uint64_t nr) {
+    return blkdev_issue_discard(sb->s_bdev, block * (ASSOOFS_DEFAULT_BLOCK_SIZE >> 9), nr * (ASSOOFS_DEFAULT_BLOCK_SIZE >> 9), GFP_NOFS, 0);
+}
+
+/*
+ *  Discard asíncrono (-o discard): se hace de una vez a los bloques liberados en el último ASSOOFS_DISCARD_DELAY,
+ *  juntando los que son consecutivos
+ */
+static void assoofs_discard_worker(struct work_struct *work) {
+    struct assoofs_mount_info *mi = container_of(to_delayed_work(work), struct assoofs_mount_info, discard_work);
+    DECLARE_BITMAP(batch, 64);
+    unsigned long start, end;
+
+    mutex_lock(&mi->free_lock);
+    bitmap_copy(batch, mi->pending_discard, 64);
+    mutex_unlock(&mi->free_lock);
+
+    start = find_first_bit(batch, 64);
+    while (start < 64) {
+        end = find_next_zero_bit(batch, 64, start);
+        if (assoofs_discard_blocks(mi->sb, start, end - start))
+            printk(KERN_WARNING "Discard of blocks [%lu-%lu] has failed\n", start, end - 1);
+        start = find_next_bit(batch, 64, end);
+    }
+
+    //Ya se pueden volver a asignar
+    mutex_lock(&mi->free_lock);
+    bitmap_andnot(mi->pending_discard, mi->pending_discard, batch, 64);
+    mutex_unlock(&mi->free_lock);
+}
+
+/*
+ *  FITRIM: discard de los tramos de bloques libres dentro de range que tengan al menos range->minlen bytes
+ */
+int assoofs_trim_fs(struct super_block *sb, struct fstrim_range *range) {
+    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+    DECLARE_BITMAP(claimed, 64);
+    uint64_t first, last, minlen, trimmed = 0;
+    unsigned long i, start, end;
+    int ret = 0;
+
+    printk(KERN_INFO "Trim request\n");
+
+    if (range->start >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED * ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        range->len = 0;
+        return 0;
+    }
+    first = max_t(uint64_t, range->start / ASSOOFS_DEFAULT_BLOCK_SIZE, ASSOOFS_LAST_RESERVED_BLOCK + 1);
+    last = min_t(uint64_t, range->len, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    last = min_t(uint64_t, (range->start + last) / ASSOOFS_DEFAULT_BLOCK_SIZE, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+    minlen = max_t(uint64_t, DIV_ROUND_UP(range->minlen, ASSOOFS_DEFAULT_BLOCK_SIZE), 1);
+
+    //Apartamos los bloques libres del rango para que no se asignen mientras se les hace discard
+    bitmap_zero(claimed, 64);
+    mutex_lock(&mi->free_lock);
+    for (i = first; i < last; i++) {
+        if ((assoofs_sb->free_blocks & (1ULL << i)) && !test_bit(i, mi->pending_discard)) {
+            set_bit(i, claimed);
+            set_bit(i, mi->pending_discard);
+        }
+    }
+    mutex_unlock(&mi->free_lock);
+
+    start = find_first_bit(claimed, 64);
+    while (start < 64) {
+        end = find_next_zero_bit(claimed, 64, start);
+        if (end - start >= minlen) {
+            ret = assoofs_discard_blocks(sb, start, end - start);
+            if (ret)
+                break;
+            trimmed += (end - start) * ASSOOFS_DEFAULT_BLOCK_SIZE;
+        }
+        start = find_next_bit(claimed, 64, end);
+    }
+
+    mutex_lock(&mi->free_lock);
+    bitmap_andnot(mi->pending_discard, mi->pending_discard, claimed, 64);
+    mutex_unlock(&mi->free_lock);
+
+    range->len = trimmed;
+    return ret;
+}
+
+/*
+ *  Opciones de montaje
+ */
+enum {
+    Opt_discard, Opt_nodiscard, Opt_err
+};
+
+static const match_table_t assoofs_tokens = {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_err, NULL}
 };
 
+int assoofs_parse_options(struct assoofs_mount_info *mi, char *options) {
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+
+        switch (match_token(p, assoofs_tokens, args)) {
+        case Opt_discard:
+            mi->discard = true;
+            break;
+        case Opt_nodiscard:
+            mi->discard = false;
+            break;
+        default:
+            printk(KERN_ERR "Unknown mount option: [%s]\n", p);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int assoofs_show_options(struct seq_file *m, struct dentry *root) {
+    if (assoofs_mount_info(root->d_sb)->discard)
+        seq_puts(m, ",discard");
+    return 0;
+}
+
+/*
+ *  Al desmontar se hacen los discard pendientes y se libera la información en memoria del superbloque
+ */
+static void assoofs_put_super(struct super_block *sb) {
+    struct assoofs_mount_info *mi = assoofs_mount_info(sb);
+
+    flush_delayed_work(&mi->discard_work);
+    sb->s_fs_info = NULL;
+    kfree(mi);
+}
+
+/*
+ *  Cuando el último usuario suelta un inodo sin enlaces, se liberan su bloque y su entrada del almacén
+ */
+static void assoofs_evict_inode(struct inode *inode) {
+    struct assoofs_inode_info *inode_info = inode->i_private;
+
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+
+    if (!inode_info)
+        return;
+
+    if (!inode->i_nlink) {
+        printk(KERN_INFO "Freeing inode [%llu]\n", inode_info->inode_no);
+        assoofs_free_inode_info(inode->i_sb, inode_info);
+    }
+
+    kfree(inode_info);
+    inode->i_private = NULL;
+}
+
 /*
  *  Inicialización del superbloque
  */
@@ -556,7 +1982,9 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     //Creacion de variables
     struct buffer_head *bh;
     struct assoofs_super_block_info *assoofs_sb; //sb en disco
+    struct assoofs_mount_info *mi; //sb en memoria
     struct inode *root_inode;
+    struct assoofs_inode_info *root_inode_info;
 
     printk(KERN_INFO "assoofs_fill_super request\n");
 
@@ -578,15 +2006,56 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
        return -1;
     }
 
+    if((assoofs_sb->features & ASSOOFS_FEATURE_METADATA_CSUM) && *assoofs_block_csum(bh->b_data) != assoofs_compute_csum(bh->b_data)){
+       printk(KERN_ERR "Superblock checksum mismatch\n");
+       brelse(bh);
+       return -EIO;
+    }
+
+    //Copiamos la información persistente a memoria, junto con el estado del montaje
+    mi = kzalloc(sizeof(*mi), GFP_KERNEL);
+    if(!mi){
+        brelse(bh);
+        return -ENOMEM;
+    }
+    memcpy(&mi->info, assoofs_sb, sizeof(mi->info));
+    mi->sb = sb;
+    mutex_init(&mi->free_lock);
+    INIT_DELAYED_WORK(&mi->discard_work, assoofs_discard_worker);
+
+    if(assoofs_parse_options(mi, data)){
+        kfree(mi);
+        brelse(bh);
+        return -EINVAL;
+    }
+    if(mi->discard && !blk_queue_discard(bdev_get_queue(sb->s_bdev))){
+        printk(KERN_WARNING "The device does not support discard, ignoring the discard option\n");
+        mi->discard = false;
+    }
+
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
     sb->s_magic=ASSOOFS_MAGIC; //asignar num magic 
-    sb->s_maxbytes=ASSOOFS_DEFAULT_BLOCK_SIZE;  //asiganr tam bloque
+    sb->s_maxbytes=ASSOOFS_MAX_FILE_SIZE;  //tam maximo de fichero (comprimido, hasta 4 bloques)
     sb->s_op=&assoofs_sops;  //asignar operaciones a sb
-    sb->s_fs_info=assoofs_sb; //para no tener que acceder ctmt al bloque 0 del disco
+    sb->s_fs_info=&mi->info; //para no tener que acceder ctmt al bloque 0 del disco
+
+    //Un volumen lleno tambien tiene free_inodes a 0, pero entonces reconstruirlo no cambia nada
+    if(!mi->info.free_inodes && assoofs_rebuild_free_inodes(sb)){
+        sb->s_fs_info = NULL;
+        kfree(mi);
+        brelse(bh);
+        return -EIO;
+    }
 
 
     // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
     root_inode=new_inode(sb);
+    if(!root_inode){
+        sb->s_fs_info = NULL;
+        kfree(mi);
+        brelse(bh);
+        return -ENOMEM;
+    }
     inode_init_owner(root_inode, NULL, S_IFDIR); // S_IFDIR para directorios, S_IFREG para ficheros.
     root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER; // numero de inodo
     root_inode->i_sb = sb; // Puntero al superbloque
@@ -598,13 +2067,24 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
                                                     la segunda cuando creemos inodos para ficheros.
                                                   */
     root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode); // Fechas
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER); // Informacion persistente del inodo
+    root_inode_info = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER); // Informacion persistente del inodo
+    if(IS_ERR(root_inode_info)){
+        iput(root_inode);
+        sb->s_fs_info = NULL;
+        kfree(mi);
+        brelse(bh);
+        return PTR_ERR(root_inode_info);
+    }
+    root_inode->i_private = root_inode_info;
+    assoofs_set_i_blocks(root_inode);
 
     //Al tratarse de un inodo raiz
     sb->s_root = d_make_root(root_inode);
     if(!sb->s_root){
+        sb->s_fs_info = NULL;
+        kfree(mi);
         brelse(bh);
-        return -1;
+        return -ENOMEM;
     }
 
     //LIberamos recursos
@@ -672,3 +2152,4 @@ static void __exit assoofs_exit(void) {
 
 module_init(assoofs_init);
 module_exit(assoofs_exit);
+MODULE_LICENSE("GPL");  //mnt_want_write_file y noop_direct_IO solo se exportan a modulos GPL
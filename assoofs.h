@@ -9,26 +9,68 @@ const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;
 const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
 const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
 
+//Flags de inodo
+#define ASSOOFS_COMPR_FL 0x1        //se ha pedido compresion para el fichero (chattr +c)
+#define ASSOOFS_COMPRESSED_FL 0x2   //el bloque de datos esta guardado comprimido con LZ4
+//Un fichero comprimido guarda en su bloque hasta 4 bloques de datos
+#define ASSOOFS_MAX_FILE_SIZE (4 * ASSOOFS_DEFAULT_BLOCK_SIZE)
+
+//Caracteristicas del sistema de ficheros (campo features del superbloque)
+#define ASSOOFS_FEATURE_METADATA_CSUM 0x1   //superbloque, almacen de inodos y directorios llevan crc32c
+#define ASSOOFS_FEATURE_INODE_FLAGS 0x2     //el campo flags de los inodos es valido (antes era relleno sin inicializar)
+//Los bloques de metadatos guardan el crc32c en sus ultimos 4 bytes
+#define ASSOOFS_BLOCK_CHECKSUM_OFFSET (ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(uint32_t))
+
 struct assoofs_super_block_info {
     uint64_t version;
     uint64_t magic;
     uint64_t block_size;    
     uint64_t inodes_count;
     uint64_t free_blocks;
-    char padding[4056];
+    uint64_t free_inodes;   //mapa de bits de numeros de inodo libres (1 libre, 0 ocupado)
+    uint8_t block_shared[64];   //referencias extra a cada bloque por reflink (0 si solo lo usa un fichero)
+    uint64_t features;          //ASSOOFS_FEATURE_*
+    char padding[3972];
+    uint32_t checksum;          //crc32c del resto del bloque, si esta ASSOOFS_FEATURE_METADATA_CSUM
 };
 
 struct assoofs_dir_record_entry {
     char filename[ASSOOFS_FILENAME_MAXLEN];
     uint64_t inode_no;
 };
+//Entradas que caben en el bloque de un directorio sin pisar el checksum
+#define ASSOOFS_MAX_DIR_ENTRIES (ASSOOFS_BLOCK_CHECKSUM_OFFSET / sizeof(struct assoofs_dir_record_entry))
 
 struct assoofs_inode_info {
     mode_t mode;
+    uint32_t flags;
     uint64_t inode_no; //numero inodo
-    uint64_t data_block_number;	//numero bloque de dicho inodo
+    uint64_t data_block_number;	//numero bloque de dicho inodo (0 si el fichero aun no tiene datos, es un hueco)
     union {
         uint64_t file_size;	//esto para fichero
         uint64_t dir_children_count;	//esto para directorios (fich dentro de el)
     };
 };
+
+//Cabecera al principio del bloque de un fichero comprimido, seguida de los datos LZ4
+struct assoofs_compressed_header {
+    uint32_t compressed_size;
+};
+
+//ioctl ASSOOFS_IOC_BULKSTAT: devuelve por lotes la informacion de los inodos leyendo el almacen de inodos de una pasada
+struct assoofs_bulkstat_entry {
+    uint64_t inode_no;
+    uint32_t mode;
+    uint32_t flags;
+    uint64_t size;
+    uint64_t data_block_number;  //0 si es un hueco
+};
+
+struct assoofs_bulkstat_req {
+    uint64_t cursor;    //primer numero de inodo a mirar; a la vuelta, por donde seguir
+    uint32_t count;     //entradas que caben en entries; a la vuelta, las que se han rellenado
+    uint32_t padding;
+    uint64_t entries;   //puntero a un array de struct assoofs_bulkstat_entry
+};
+
+#define ASSOOFS_IOC_BULKSTAT _IOWR('a', 1, struct assoofs_bulkstat_req)
@@ -11,6 +11,34 @@
 #define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
 #define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
 
+//crc32c (Castagnoli), el mismo que calcula crc32c() en el kernel
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    int i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+    return crc;
+}
+
+//Checksums de metadatos: opcionales (-c) hasta medir cuanto cuestan en create/lookup
+static int metadata_csum;
+
+//Guarda en los ultimos 4 bytes del bloque de metadatos el checksum del resto
+static void set_block_checksum(char *block) {
+    uint32_t crc;
+
+    if (!metadata_csum)
+        return;
+
+    crc = crc32c(~0U, block, ASSOOFS_BLOCK_CHECKSUM_OFFSET);
+
+    memcpy(block + ASSOOFS_BLOCK_CHECKSUM_OFFSET, &crc, sizeof(crc));
+}
+
 static int write_superblock(int fd) { //recibe descriptor
     struct assoofs_super_block_info sb = {
         .version = 1,
@@ -18,9 +46,13 @@ static int write_superblock(int fd) { //recibe descriptor
         .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
         .inodes_count = WELCOMEFILE_INODE_NUMBER,
         .free_blocks = (~0) & ~(15), //1 bloque libre, 0 ocupado
+        .free_inodes = (~0ULL) & ~((1ULL << (WELCOMEFILE_INODE_NUMBER + 1)) - 1), //inodo 0 reservado, raiz y bienvenida ocupados
+        .features = ASSOOFS_FEATURE_INODE_FLAGS | (metadata_csum ? ASSOOFS_FEATURE_METADATA_CSUM : 0),
     };
     ssize_t ret;
 
+    set_block_checksum((char *)&sb);
+
     ret = write(fd, &sb, sizeof(sb));  //escribir superbloque
     if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
         printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
@@ -31,42 +63,31 @@ static int write_superblock(int fd) { //recibe descriptor
     return 0;
 }
 
-static int write_root_inode(int fd) {  //inodo raiz
-    ssize_t ret;
-
-    struct assoofs_inode_info root_inode;
+static int write_root_inode(char *inode_store) {  //inodo raiz
+    struct assoofs_inode_info root_inode = { 0 };
 
     root_inode.mode = S_IFDIR;	//directorio
     root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
     root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
     root_inode.dir_children_count = 1;	//archivos tiene dentro (readme.txt)
 
-    ret = write(fd, &root_inode, sizeof(root_inode));	//escribimos
-
-    if (ret != sizeof(root_inode)) {
-        printf("The inode store was not written properly.\n");
-        return -1;
-    }
+    memcpy(inode_store, &root_inode, sizeof(root_inode));	//primera entrada del almacen
 
     printf("root directory inode written succesfully.\n");
     return 0;
 }
 
-static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) { //fichero bienvenida
-    off_t nbytes;
+static int write_welcome_inode(int fd, char *inode_store, const struct assoofs_inode_info *i) { //fichero bienvenida
     ssize_t ret;
 
-    ret = write(fd, i, sizeof(*i)); //escribimos
-    if (ret != sizeof(*i)) {
-        printf("The welcomefile inode was not written properly.\n");
-        return -1;
-    }
+    memcpy(inode_store + sizeof(*i), i, sizeof(*i)); //segunda entrada del almacen
     printf("welcomefile inode written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2); //meter espacio en blanco: tam bloque - inodo raiz (2,root y bienvenida)
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("The padding bytes are not written properly.\n");
+    //El resto del bloque queda a cero; se escribe entero para que el checksum cubra tambien el relleno
+    set_block_checksum(inode_store);
+    ret = write(fd, inode_store, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        printf("The inode store was not written properly.\n");
         return -1;
     }
 
@@ -75,22 +96,18 @@ static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) { //f
 }
 
 int write_dirent(int fd, const struct assoofs_dir_record_entry *record) { //entrada de directorio
-    ssize_t nbytes = sizeof(*record), ret;
+    char block[ASSOOFS_DEFAULT_BLOCK_SIZE] = { 0 };  //entrada + relleno a cero
+    ssize_t ret;
 
-    ret = write(fd, record, nbytes);
-    if (ret != nbytes) {
+    memcpy(block, record, sizeof(*record));
+    set_block_checksum(block);
+
+    ret = write(fd, block, sizeof(block));
+    if (ret != sizeof(block)) {
         printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
         return -1;
     }
     printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
-
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record); //anyadimos relleno: bloque - tam entrada
-    ret = lseek(fd, nbytes, SEEK_CUR);
-    if (ret == (off_t)-1) {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
-        return -1;
-    }
-    printf("Padding after the rootdirectory children written succesfully.\n");
     return 0;
 }
 
@@ -110,6 +127,7 @@ int main(int argc, char *argv[])
 {
     int fd;
     ssize_t ret;
+    char inode_store[ASSOOFS_DEFAULT_BLOCK_SIZE] = { 0 };
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n"; //mensaje
     
     struct assoofs_inode_info welcome = {  //i-nodo bienvenida
@@ -124,8 +142,14 @@ int main(int argc, char *argv[])
         .inode_no = WELCOMEFILE_INODE_NUMBER,
     };
 
+    if (argc == 3 && !strcmp(argv[1], "-c")) { //-c: superbloque, almacen de inodos y directorios con crc32c
+        metadata_csum = 1;
+        argv++;
+        argc--;
+    }
+
     if (argc != 2) {
-        printf("Usage: mkassoofs <device>\n");
+        printf("Usage: mkassoofs [-c] <device>\n");
         return -1;
     }
 
@@ -140,10 +164,10 @@ int main(int argc, char *argv[])
         if (write_superblock(fd))
             break;
 
-        if (write_root_inode(fd))
+        if (write_root_inode(inode_store))
             break;
         
-        if (write_welcome_inode(fd, &welcome)) //inoo hemos creado
+        if (write_welcome_inode(fd, inode_store, &welcome)) //inoo hemos creado
             break;
 
         if (write_dirent(fd, &record)) //entrada de directorio